@@ -5,6 +5,7 @@
 /// I present 3 flavors of a thread-safe, dynamic, non-linearizable, multiple-producer-multiple-consumer (MPMC) FIFO linked-list.
 /// These differ from other implemantations in that memory is unbounded AND some flavors provide memory reclamation.
 /// This has the advantage of usability and unbound memory, at the cost of variable heap usage and performance.
+/// An optional memory budget can be given at construction to put a ceiling on the backlog; see `overflowPolicy`.
 ///
 /// Set this value to determine the method of synchronization and memory reclamation.
 /// 0: synchronize using a mutex, delete as soon as a node is removed. Good for SPSC. Has memory reclamation. This is the KISS approach.
@@ -12,12 +13,25 @@
 /// 2: synchronize lock-free using Harris' algorithm. Good for SPMC, MPSC, and MPMC. Does not have memory reclamation.
 #define SYNC_RECL_METHOD 2
 
+/// Every atomic access names the weakest memory order that keeps the algorithm correct. Define CONCURRENT_QUEUE_SEQ_CST
+/// (e.g. -DCONCURRENT_QUEUE_SEQ_CST=ON in CMake) to force them all back to std::memory_order_seq_cst for A/B comparisons.
+#ifdef CONCURRENT_QUEUE_SEQ_CST
+   #define CQ_MEM_ORDER(order) std::memory_order_seq_cst
+#else
+   #define CQ_MEM_ORDER(order) std::memory_order_##order
+#endif
+
 #include <atomic>
 #include <exception>
 #include <utility>
 #include <memory>
 #include <cassert>
 #include <condition_variable>
+#include <stdexcept>
+#include <limits>
+#include <functional>
+#include <thread>
+#include <algorithm>
 
 #if SYNC_RECL_METHOD == 0
    /// This is the naive approach, but it may be the best when little contention is expected.
@@ -35,7 +49,7 @@
    #define optionalSync()
    #define node_pack_next(ptr_as_uint) (ptr_as_uint >> 1)
    #define node_unpack_next(ptr_as_uint) (ptr_as_uint << 1)
-   #define CAS(n, old, new) n.compare_exchange_weak( old, new )
+   #define CAS(n, old, new, order) n.compare_exchange_weak( old, new, CQ_MEM_ORDER(order), CQ_MEM_ORDER(relaxed) )
    #define defaultControlBlock() { {.marker = 0, .nextPtr = 0, .refCount = 1} }
    constexpr int numRefCountBits = 16;
 #else
@@ -45,7 +59,7 @@
    #define optionalSync()
    #define node_pack_next(ptr_as_uint) (ptr_as_uint >> 1)
    #define node_unpack_next(ptr_as_uint) (ptr_as_uint << 1)
-   #define CAS(n, old, new) n.compare_exchange_weak( old, new )
+   #define CAS(n, old, new, order) n.compare_exchange_weak( old, new, CQ_MEM_ORDER(order), CQ_MEM_ORDER(relaxed) )
    #define defaultControlBlock() { {0} }
    constexpr int numRefCountBits = 0;
 #endif
@@ -58,6 +72,28 @@ template< typename ELEMENT_T >
 class concurrentQueue
 {
 public:
+   /// What a producer does when the queue is over budget.
+   enum class overflowPolicy
+   {
+      fail,       /// push\_back() returns `false` and the element is left untouched
+      block,      /// push\_back() blocks until consumers release budget
+      dropOldest  /// the front element is popped to make room, falling back to `fail` if nothing can be popped
+   };
+
+   /// The unit the budget is expressed in. Bytes are converted to a node count, rounded down, so element-owned heap memory is not counted.
+   enum class budgetUnit { elements, bytes };
+
+   /// Counters of how often producers hit the budget. Only touched on the over-budget path.
+   struct budgetStats
+   {
+      size_t rejected = 0;
+      size_t blocked = 0;
+      size_t dropped = 0;
+   };
+
+   /// Called every time a producer finds the queue over budget, before the policy is applied.
+   using budgetPressureHook = std::function<void( overflowPolicy )>;
+
    class node
    {
       friend class concurrentQueue;
@@ -86,45 +122,49 @@ public:
       ELEMENT_T value;
       node() {}
       inline node(ELEMENT_T && v ) noexcept : value( v ) {}
-      inline controlBlock load() const { return _controlBlock.load(); }
+      inline controlBlock load() const { return _controlBlock.load( CQ_MEM_ORDER(acquire) ); }
       static inline node * allocAligned( ELEMENT_T && v ) { return new( std::align_val_t(8)) node( std::forward<ELEMENT_T>(v) ); }
 
    private:
       std::atomic<controlBlock> _controlBlock = defaultControlBlock();
       static_assert( sizeof(_controlBlock) == sizeof(uintptr_t), "controlBLock is not sizeof(uintptr_t)" );
 
-      node * next() const { return reinterpret_cast<node *>( node_unpack_next(_controlBlock.load().nextPtr) ); }
-      void next( node * next )
+      node * next() const { return reinterpret_cast<node *>( node_unpack_next(_controlBlock.load( CQ_MEM_ORDER(acquire) ).nextPtr) ); }
+      /// Not atomic as a whole; only for nodes no other thread can modify yet (or under a lock). Use relaxed for nodes that
+      /// are not yet published, the default release when the store itself publishes `next`.
+      void next( node * next, std::memory_order order = CQ_MEM_ORDER(release) )
       {
-         auto ctrlBlock = _controlBlock.load();
+         auto ctrlBlock = _controlBlock.load( CQ_MEM_ORDER(relaxed) );
          ctrlBlock.nextPtr = node_pack_next( reinterpret_cast<uintptr_t>(next) );
-         _controlBlock.store(ctrlBlock);
+         _controlBlock.store( ctrlBlock, order );
       }
-      bool logicallyRemoved() const { return _controlBlock.load().marker == 1; }
+      bool logicallyRemoved() const { return _controlBlock.load( CQ_MEM_ORDER(acquire) ).marker == 1; }
       
 #if SYNC_RECL_METHOD == 1
+      /// Taking a reference orders nothing, the caller already reached the node through an acquire load (same as std::shared_ptr)
       static inline void addRef( node * n ) noexcept
       {
-         auto oldBlock = n->_controlBlock.load();
+         auto oldBlock = n->_controlBlock.load( CQ_MEM_ORDER(relaxed) );
          do
          {
             auto newBlock = oldBlock;
             newBlock.refCount += 1;
-            if ( CAS(n->_controlBlock, oldBlock, newBlock) )
+            if ( CAS(n->_controlBlock, oldBlock, newBlock, relaxed) )
                break;
          } while ( true );
       }
       static inline void decRef( node * n, bool test_canDelete = true ) noexcept
       {
          int rc = 0;
-         auto oldBlock = n->_controlBlock.load();
+         auto oldBlock = n->_controlBlock.load( CQ_MEM_ORDER(relaxed) );
          do
          {
             auto newBlock = oldBlock;
             newBlock.refCount -= 1;
             rc = newBlock.refCount;
             assert( rc >= 0 );
-            if ( CAS(n->_controlBlock, oldBlock, newBlock) ) // TODO: move refCount to the lower bits and use a fetch-and-add instead, should be faster
+            // acq_rel so that whoever drops the last reference sees every other holder's accesses before deleting
+            if ( CAS(n->_controlBlock, oldBlock, newBlock, acq_rel) ) // TODO: move refCount to the lower bits and use a fetch-and-add instead, should be faster
                break;
          } while ( true );
 
@@ -178,7 +218,36 @@ public:
    {
       _head = node::allocAligned( {} );
       _tail = nullptr;
-      _head->next( _tail );
+      _head->next( _tail, CQ_MEM_ORDER(relaxed) );
+   }
+   /// Bounded flavor. The budget is tracked in per-thread reservation chunks rather than one shared counter, so producers and
+   /// consumers only touch the global pool once per chunk. There is one slot per hardware thread (up to `numBudgetSlots`), and up
+   /// to `2 * chunk` credits may be parked in each; producers sweep those back before declaring the queue over budget.
+   /// A budget too small to give every slot a few chunks uses a single slot holding all of it, i.e. one shared counter.
+   /// Throws std::invalid_argument if the budget cannot hold a single element.
+   explicit concurrentQueue( size_t budget, budgetUnit unit = budgetUnit::elements, overflowPolicy policy = overflowPolicy::block ) :
+      concurrentQueue()
+   {
+      if ( unit == budgetUnit::bytes )
+         budget /= sizeof(node); // Round down, the budget is a ceiling
+      if ( budget == 0 )
+         throw std::invalid_argument( "concurrentQueue budget must hold at least one element" );
+      budget = std::min<size_t>( budget, std::numeric_limits<long>::max() ); // Credits are signed
+
+      size_t numSlots = std::clamp<size_t>( std::thread::hardware_concurrency(), 1, numBudgetSlots );
+      while ( numSlots & (numSlots - 1) ) // Round down to a power of two so a slot is picked with a mask
+         numSlots &= numSlots - 1;
+      long chunk = long(budget / (numSlots * 4));
+      if ( chunk < minBudgetChunk )
+      {
+         numSlots = 1;
+         chunk = long(budget);
+      }
+      _budgetPolicy = policy;
+      _budgetChunk = std::min( chunk, maxBudgetChunk );
+      _budgetSlotMask = numSlots - 1;
+      _budgetSlots.reset( new budgetSlot[numSlots] );
+      _budgetGlobal = long(budget);
    }
    ~concurrentQueue()
    {
@@ -225,7 +294,7 @@ public:
          onNodeRemoved(n);
          n = next;
       }
-      _head->next( nullptr );
+      _head->next( nullptr, CQ_MEM_ORDER(relaxed) );
       _size = 0;
       _cv.notify_one();
    }
@@ -236,8 +305,25 @@ public:
       auto leftAndRight = const_cast<concurrentQueue *>(this)->search( _head, true );
       return leftAndRight.right != nullptr ? std::make_optional(std::ref(leftAndRight.right->value)) : std::nullopt;
    }
-   void push_back( ELEMENT_T && element )
+   /// Returns `false` only if the queue is over budget and the policy is `fail`, or `dropOldest` found nothing to drop after
+   /// `maxDropAttempts` tries. In that case `element` is not moved from.
+   bool push_back( ELEMENT_T && element )
+   {
+      return push_back( std::forward<ELEMENT_T>(element), _budgetPolicy );
+   }
+
+   /// Never blocks. Returns `false` if the queue is over budget, unless the policy is `dropOldest`.
+   bool try_push( ELEMENT_T && element )
    {
+      return push_back( std::forward<ELEMENT_T>(element), _budgetPolicy == overflowPolicy::block ? overflowPolicy::fail : _budgetPolicy );
+   }
+
+   /// Same as above, overriding the queue's policy for this call only. The policy is ignored for unbounded queues.
+   bool push_back( ELEMENT_T && element, overflowPolicy policy )
+   {
+      if ( !reserveBudget( policy ) )
+         return false;
+
       // This allocation guarantees that the LSB will always be zero
       auto newNode = node::allocAligned( std::forward<ELEMENT_T>(element) );
       assert( !newNode->logicallyRemoved() );
@@ -253,24 +339,36 @@ public:
       }
       current->next( newNode );
 #else
-      ++_concurrencyCount;
+      _concurrencyCount.fetch_add( 1, CQ_MEM_ORDER(relaxed) );
       do {
          auto leftAndRight = search( _head, false ); // TODO: we can improve this, starting somewhere other than head
 
          //T1 doesn't apply to this specialization
-         newNode->next( node_raw(leftAndRight.right) );
+         newNode->next( node_raw(leftAndRight.right), CQ_MEM_ORDER(relaxed) ); // Private until C2 publishes it
 
-         auto oldControlBlock = leftAndRight.left->_controlBlock.load();
+         auto oldControlBlock = leftAndRight.left->_controlBlock.load( CQ_MEM_ORDER(relaxed) ); // C2 validates this
          oldControlBlock.nextPtr = node_pack_next( reinterpret_cast<uintptr_t>(node_raw(leftAndRight.right)) );
+         oldControlBlock.marker = 0; // Never link onto a logically removed node, it would be unlinked along with it
          auto newControlBlock = oldControlBlock;
          newControlBlock.nextPtr = node_pack_next( reinterpret_cast<uintptr_t>(newNode) );
-         if ( CAS(leftAndRight.left->_controlBlock, oldControlBlock, newControlBlock) ) //C2
+         if ( CAS(leftAndRight.left->_controlBlock, oldControlBlock, newControlBlock, release) ) //C2, publishes newNode
             break;
       } while (true); //B3
-      --_concurrencyCount;
+      _concurrencyCount.fetch_sub( 1, CQ_MEM_ORDER(relaxed) );
 #endif
-      _size.fetch_add( 1, std::memory_order_relaxed );
+      _size.fetch_add( 1, CQ_MEM_ORDER(relaxed) );
       _cv.notify_one();
+      return true;
+   }
+
+   /// Not synchronized with producers; install before the queue is shared.
+   void set_budget_pressure_hook( budgetPressureHook hook ) { _budgetHook = std::move(hook); }
+
+   budgetStats budget_stats() const noexcept
+   {
+      return { _budgetRejected.load( CQ_MEM_ORDER(relaxed) ),
+               _budgetBlocked.load( CQ_MEM_ORDER(relaxed) ),
+               _budgetDropped.load( CQ_MEM_ORDER(relaxed) ) };
    }
 
    bool pop_front() noexcept
@@ -285,13 +383,13 @@ public:
 #else
       searchResult leftAndRight;
       sharedNode rightNext;
-      ++_concurrencyCount;
+      _concurrencyCount.fetch_add( 1, CQ_MEM_ORDER(relaxed) );
       do
       {
          leftAndRight = search( _head, true );
          if ( leftAndRight.right == nullptr ) //T1
          {
-            --_concurrencyCount; // TODO: TESTING. Remove these
+            _concurrencyCount.fetch_sub( 1, CQ_MEM_ORDER(relaxed) ); // TODO: TESTING. Remove these
             return false;
          }
 
@@ -299,26 +397,33 @@ public:
          rightNext = leftAndRight.right->next();
          if ( !leftAndRight.right->logicallyRemoved() )
          {
-            auto oldControlBlock = leftAndRight.right->_controlBlock.load();
+            // Expect the `rightNext` snapshot, not a fresh load, otherwise a push that links onto `right` in between would be
+            // unlinked along with it by C4
+            auto oldControlBlock = leftAndRight.right->_controlBlock.load( CQ_MEM_ORDER(relaxed) );
+            oldControlBlock.nextPtr = node_pack_next( reinterpret_cast<uintptr_t>(node_raw(rightNext)) );
+            oldControlBlock.marker = 0;
             auto newControlBlock = oldControlBlock;
             newControlBlock.marker = 1;
-            if ( CAS(leftAndRight.right->_controlBlock, oldControlBlock, newControlBlock) ) //C3
+            // acq_rel: the winner owns the removal and hands the node to onNodeRemoved(), so it must see the last update to it
+            if ( CAS(leftAndRight.right->_controlBlock, oldControlBlock, newControlBlock, acq_rel) ) //C3
                break;
          }
       } while ( true ); //B4
 
-      auto oldControlBlock = leftAndRight.left->_controlBlock.load();
+      auto oldControlBlock = leftAndRight.left->_controlBlock.load( CQ_MEM_ORDER(relaxed) );
       oldControlBlock.nextPtr = node_pack_next( reinterpret_cast<uintptr_t>(node_raw(leftAndRight.right)) );
+      oldControlBlock.marker = 0; // As with Harris' C4, left must still be unmarked
       auto newControlBlock = oldControlBlock;
       newControlBlock.nextPtr = node_pack_next( reinterpret_cast<uintptr_t>(node_raw(rightNext)) );
-      bool removalSucceeded = CAS(leftAndRight.left->_controlBlock, oldControlBlock, newControlBlock); //C4
+      // release: rightNext was reached through an acquire load, so readers of left->next() must happen-after its publisher too
+      bool removalSucceeded = CAS(leftAndRight.left->_controlBlock, oldControlBlock, newControlBlock, release); //C4
       if ( !removalSucceeded )
-         leftAndRight = search( leftAndRight.left, false ); // Concurrency collision, let search() try and remove marked nodes
+         search( _head, true ); // Concurrency collision, let search() unlink the marked front node (and return its budget)
       else
          onNodeRemoved( node_raw(leftAndRight.right) );
-      --_concurrencyCount;
+      _concurrencyCount.fetch_sub( 1, CQ_MEM_ORDER(relaxed) );
 #endif
-      return leftAndRight.right != nullptr;
+      return true; // This call removed the front node (it won C3), even if someone else unlinks it
    }
    
    /// Blocks until at least one element has been added.
@@ -348,6 +453,144 @@ private:
    std::condition_variable _cv;
    std::mutex _cvMutex;
 
+   /// Budget bookkeeping. Credits live either in `_budgetGlobal` or in one of the per-thread slots; a push spends one, a removal
+   /// returns one. Slots are only allocated for bounded queues, so the unbounded flavor pays a single branch per operation.
+   static constexpr size_t numBudgetSlots = 16;
+   static constexpr long minBudgetChunk = 4;
+   static constexpr long maxBudgetChunk = 64;
+   static constexpr int maxDropAttempts = 64;
+   struct alignas(64) budgetSlot
+   {
+      std::atomic_long credits = 0;
+   };
+   std::unique_ptr<budgetSlot[]> _budgetSlots;
+   std::atomic_long _budgetGlobal = 0;
+   long _budgetChunk = 0;
+   size_t _budgetSlotMask = 0;
+   overflowPolicy _budgetPolicy = overflowPolicy::fail;
+   std::atomic_int _budgetWaiters = 0;
+   std::condition_variable _budgetCv;
+   budgetPressureHook _budgetHook;
+   std::atomic_size_t _budgetRejected = 0;
+   std::atomic_size_t _budgetBlocked = 0;
+   std::atomic_size_t _budgetDropped = 0;
+
+   inline budgetSlot & localBudgetSlot() noexcept
+   {
+      static std::atomic_size_t nextSlot = 0;
+      static thread_local size_t slot = nextSlot.fetch_add( 1, CQ_MEM_ORDER(relaxed) );
+      return _budgetSlots[slot & _budgetSlotMask];
+   }
+
+   /// Spend one credit from this thread's slot, falling back to the slow path when it runs dry.
+   inline bool reserveBudget( overflowPolicy policy )
+   {
+      if ( !_budgetSlots )
+         return true;
+      auto & slot = localBudgetSlot().credits;
+      if ( slot.fetch_sub( 1, CQ_MEM_ORDER(relaxed) ) > 0 )
+         return true;
+      slot.fetch_add( 1, CQ_MEM_ORDER(relaxed) );
+      return reserveBudgetSlow( slot, policy );
+   }
+
+   bool reserveBudgetSlow( std::atomic_long & slot, overflowPolicy policy )
+   {
+      if ( refillBudget( slot ) )
+         return true;
+
+      if ( _budgetHook )
+         _budgetHook( policy );
+
+      switch ( policy )
+      {
+      case overflowPolicy::fail:
+         _budgetRejected.fetch_add( 1, CQ_MEM_ORDER(relaxed) );
+         return false;
+
+      case overflowPolicy::dropOldest:
+         // Each successful pop returns a credit through onNodeRemoved(). If the queue looks empty the credits are in flight
+         // with another thread, so give it a chance to finish, but not forever.
+         for ( int attempt = 0; attempt < maxDropAttempts; ++attempt )
+         {
+            if ( pop_front() )
+               _budgetDropped.fetch_add( 1, CQ_MEM_ORDER(relaxed) );
+            else
+               std::this_thread::yield();
+            if ( refillBudget( slot ) )
+               return true;
+         }
+         _budgetRejected.fetch_add( 1, CQ_MEM_ORDER(relaxed) );
+         return false;
+
+      case overflowPolicy::block:
+      {
+         _budgetBlocked.fetch_add( 1, CQ_MEM_ORDER(relaxed) );
+         std::unique_lock<std::mutex> autoLock( _cvMutex );
+         _budgetWaiters.fetch_add( 1, CQ_MEM_ORDER(seq_cst) ); // Pairs with releaseBudget(), see there
+         while ( !refillBudget( slot ) )
+            _budgetCv.wait( autoLock );
+         _budgetWaiters.fetch_sub( 1, CQ_MEM_ORDER(relaxed) ); // A stale count only costs a spurious notify
+         return true;
+      }
+      }
+      return false;
+   }
+
+   /// Move a chunk of credits from the global pool into `slot` and spend one of them. When the pool is empty, sweep credits
+   /// parked in other threads' slots back into it and try once more.
+   bool refillBudget( std::atomic_long & slot ) noexcept
+   {
+      auto takeChunk = [this, &slot]()
+      {
+         auto available = _budgetGlobal.load( CQ_MEM_ORDER(relaxed) );
+         while ( available > 0 )
+         {
+            auto take = std::min( available, _budgetChunk );
+            if ( _budgetGlobal.compare_exchange_weak( available, available - take, CQ_MEM_ORDER(relaxed) ) )
+            {
+               slot.fetch_add( take - 1, CQ_MEM_ORDER(relaxed) );
+               return true;
+            }
+         }
+         return false;
+      };
+
+      if ( takeChunk() )
+         return true;
+      for ( size_t i = 0; i <= _budgetSlotMask; ++i )
+      {
+         auto parked = _budgetSlots[i].credits.exchange( 0, CQ_MEM_ORDER(seq_cst) );
+         if ( parked > 0 )
+            _budgetGlobal.fetch_add( parked, CQ_MEM_ORDER(relaxed) );
+         else if ( parked < 0 ) // Caught a reserveBudget() between its fetch_sub and fetch_add; hand the debt back
+            _budgetSlots[i].credits.fetch_add( parked, CQ_MEM_ORDER(relaxed) );
+      }
+      return takeChunk();
+   }
+
+   /// Return one credit. Surplus beyond two chunks goes back to the global pool, and everything goes back if a producer is blocked.
+   inline void releaseBudget() noexcept
+   {
+      if ( !_budgetSlots )
+         return;
+      auto & slot = localBudgetSlot().credits;
+      // Sequentially consistent so that a producer registering in _budgetWaiters either sees this credit when it sweeps, or is seen here
+      auto credits = slot.fetch_add( 1, CQ_MEM_ORDER(seq_cst) ) + 1;
+      bool waiters = _budgetWaiters.load( CQ_MEM_ORDER(seq_cst) ) > 0;
+      if ( credits > 2 * _budgetChunk || waiters )
+      {
+         auto surplus = waiters ? credits : credits - _budgetChunk;
+         if ( slot.compare_exchange_strong( credits, credits - surplus, CQ_MEM_ORDER(relaxed) ) )
+            _budgetGlobal.fetch_add( surplus, CQ_MEM_ORDER(relaxed) );
+      }
+      if ( waiters )
+      {
+         std::lock_guard<std::mutex> autoLock( _cvMutex );
+         _budgetCv.notify_all();
+      }
+   }
+
    // Accepts a boolean indicating which end we care about.
    searchResult search( node * startNode, bool findFront ) noexcept
    {
@@ -398,11 +641,12 @@ private:
          }
 
          // 3: Remove one or more marked nodes. Getting here means that left and right are NOT adjacent - we have a gap.
-         auto oldControlBlock = left->_controlBlock.load();
+         auto oldControlBlock = left->_controlBlock.load( CQ_MEM_ORDER(relaxed) );
          oldControlBlock.nextPtr = node_pack_next( reinterpret_cast<uintptr_t>(node_raw(leftNext)) );
+         oldControlBlock.marker = 0; // As with Harris' C1, left must still be unmarked
          auto newControlBlock = oldControlBlock;
          newControlBlock.nextPtr = node_pack_next( reinterpret_cast<uintptr_t>(node_raw(right)) );
-         if ( CAS(left->_controlBlock, oldControlBlock, newControlBlock) ) //C1
+         if ( CAS(left->_controlBlock, oldControlBlock, newControlBlock, release) ) //C1, same reasoning as C4
          {
             // Handle removal of now-orphaned nodes in this gap, but only if logically removed
             auto n = leftNext;
@@ -429,7 +673,8 @@ private:
 #elif SYNC_RECL_METHOD == 1
          node::decRef( n );
 #endif
-         _size.fetch_sub( 1, std::memory_order_relaxed );
+         _size.fetch_sub( 1, CQ_MEM_ORDER(relaxed) );
+         releaseBudget();
    }
 };
 #endif
@@ -89,6 +89,189 @@ TEST_CASE( "concurrentQueue" )
       }
       CHECK( list.size() == 0 );
    }
+   SECTION( "budget" )
+   {
+      using queue_t = concurrentQueue<int>;
+      constexpr int budget = 100;
+
+      // fail
+      {
+         queue_t list( budget, queue_t::budgetUnit::elements, queue_t::overflowPolicy::fail );
+         int pressure = 0;
+         list.set_budget_pressure_hook( [&pressure]( queue_t::overflowPolicy ) { ++pressure; } );
+         for ( auto i = 0; i < budget; ++i )
+            CHECK( list.push_back(int(i)) );
+         CHECK( !list.push_back(int(budget)) );
+         CHECK( !list.try_push(int(budget)) );
+         CHECK( list.size() == budget );
+         CHECK( list.budget_stats().rejected == 2 );
+         CHECK( pressure == 2 );
+
+         CHECK( list.pop_front() );
+         CHECK( list.push_back(int(budget)) );
+         CHECK( !list.push_back(int(budget)) );
+      }
+
+      // dropOldest
+      {
+         queue_t list( budget, queue_t::budgetUnit::elements, queue_t::overflowPolicy::dropOldest );
+         for ( auto i = 0; i < budget * 2; ++i )
+            CHECK( list.push_back(int(i)) );
+         CHECK( list.size() == budget );
+         CHECK( list.budget_stats().dropped == budget );
+         CHECK( list.front()->get() == budget );
+      }
+
+      // block
+      {
+         queue_t list( budget, queue_t::budgetUnit::elements, queue_t::overflowPolicy::block );
+         for ( auto i = 0; i < budget; ++i )
+            CHECK( list.push_back(int(i)) );
+         CHECK( !list.try_push(int(budget)) );
+
+         std::atomic<bool> pushed = false;
+         auto producer = std::thread( [&list, &pushed] {
+            list.push_back( int(budget) );
+            pushed = true;
+         } );
+         std::this_thread::sleep_for( 50ms );
+         CHECK( !pushed );
+         CHECK( list.pop_front() );
+         producer.join();
+         CHECK( pushed );
+         CHECK( list.size() == budget );
+         CHECK( list.budget_stats().blocked == 1 );
+      }
+
+      // bytes
+      {
+         queue_t list( budget * sizeof(queue_t::node), queue_t::budgetUnit::bytes, queue_t::overflowPolicy::fail );
+         for ( auto i = 0; i < budget; ++i )
+            CHECK( list.push_back(int(i)) );
+         CHECK( !list.push_back(int(budget)) );
+      }
+
+      // Budgets are rounded down to whole nodes, and an empty budget is refused
+      {
+         queue_t list( 2 * sizeof(queue_t::node) - 1, queue_t::budgetUnit::bytes, queue_t::overflowPolicy::fail );
+         CHECK( list.push_back(0) );
+         CHECK( !list.push_back(1) );
+         CHECK_THROWS_AS( queue_t(0), std::invalid_argument );
+         CHECK_THROWS_AS( queue_t(sizeof(queue_t::node) - 1, queue_t::budgetUnit::bytes), std::invalid_argument );
+
+         queue_t huge( std::numeric_limits<size_t>::max(), queue_t::budgetUnit::elements, queue_t::overflowPolicy::fail );
+         CHECK( huge.push_back(0) );
+         static_assert( !std::is_convertible_v<size_t, queue_t>, "a budget must not implicitly convert to a queue" );
+      }
+   }
+   SECTION( "budget_MPSC" )
+   {
+      // Several producers against one consumer on a bounded queue. The queue must never hold more than the budget, and no
+      // credits may be lost: once drained, exactly `budget` pushes succeed again. Producers push in small bursts so the
+      // consumer keeps catching up and most pops race a push onto the last node.
+      using queue_t = concurrentQueue<int>;
+      constexpr int budget = 4;
+      constexpr int burst = 3;
+      int numProducers = std::max( 2, kMaxThreads );
+
+      for ( auto policy : { queue_t::overflowPolicy::fail, queue_t::overflowPolicy::block } )
+      {
+         queue_t list( budget, queue_t::budgetUnit::elements, policy );
+         std::atomic<int> pushed = 0;
+         std::atomic<int> producersDone = 0;
+
+         auto onInsert = []( queue_t * list, std::atomic<int> * pushed, std::atomic<int> * producersDone ) {
+            while (!start) { std::this_thread::yield(); }
+
+            for ( int i = 0; i < NUM_ELEMENTS_PER_THREAD; ++i )
+            {
+               if ( list->push_back( int(i) ) )
+                  ++*pushed;
+               if ( i % burst == burst - 1 )
+                  std::this_thread::sleep_for( 20us );
+            }
+            ++*producersDone;
+         };
+
+         std::vector<std::thread> threads;
+         for ( int i = 0; i < numProducers; ++i )
+            threads.push_back( std::thread(onInsert, &list, &pushed, &producersDone) );
+         start = true;
+
+         // Only this thread pops, so `pushed - popped` is a lower bound on what the queue holds
+         int popped = 0;
+         int maxHeld = 0;
+         while ( true )
+         {
+            bool allDone = producersDone == numProducers;
+            maxHeld = std::max( maxHeld, pushed - popped );
+            if ( list.pop_front() )
+               ++popped;
+            else if ( allDone )
+               break;
+            else
+               std::this_thread::yield();
+         }
+         for ( auto && thread : threads )
+            thread.join();
+         start = false;
+
+         CHECK( maxHeld <= budget );
+         CHECK( popped == pushed );
+         CHECK( list.empty() );
+         auto stats = list.budget_stats();
+         if ( policy == queue_t::overflowPolicy::block )
+            CHECK( pushed == numProducers * NUM_ELEMENTS_PER_THREAD );
+         else
+            CHECK( stats.rejected == size_t(numProducers * NUM_ELEMENTS_PER_THREAD - pushed) );
+
+         for ( auto i = 0; i < budget; ++i )
+            CHECK( list.try_push(int(i)) );
+         CHECK( !list.try_push(int(budget)) );
+      }
+   }
+   SECTION( "MPSC" )
+   {
+      // Concurrent producers and a single concurrent consumer. Every producer's elements must arrive, in order.
+      concurrentQueue<int> list;
+      int numProducers = std::max( 2, kMaxThreads );
+      int numElements = numProducers * NUM_ELEMENTS_PER_THREAD;
+
+      auto onInsert = []( concurrentQueue<int> * list, int id ) {
+         while (!start) { std::this_thread::yield(); }
+
+         for ( int i = 0; i < NUM_ELEMENTS_PER_THREAD; ++i )
+            list->push_back( id * NUM_ELEMENTS_PER_THREAD + i );
+      };
+
+      std::vector<std::thread> threads;
+      for ( int i = 0; i < numProducers; ++i )
+         threads.push_back( std::thread(onInsert, &list, i) );
+      start = true;
+
+      std::vector<int> nextExpected( numProducers, 0 );
+      for ( int count = 0; count < numElements; )
+      {
+         auto front = list.front();
+         if ( !front )
+         {
+            std::this_thread::yield();
+            continue;
+         }
+         int value = front->get();
+         int id = value / NUM_ELEMENTS_PER_THREAD;
+         CHECK( value % NUM_ELEMENTS_PER_THREAD == nextExpected[id]++ );
+         CHECK( list.pop_front() );
+         ++count;
+      }
+      for ( auto && thread : threads )
+         thread.join();
+      start = false;
+
+      for ( auto count : nextExpected )
+         CHECK( count == NUM_ELEMENTS_PER_THREAD );
+      CHECK( list.empty() );
+   }
    // TODO: Disabled until concurrentQueue is fixed
 //   SECTION( "SPSC" )
 //   {
@@ -229,3 +412,31 @@ TEST_CASE( "concurrentQueue" )
 //      CHECK( list.size() == 0 );
 //   }
 }
+
+// Hidden from the default run: `shelfTest [benchmark]`. Build once as-is and once with -DCONCURRENT_QUEUE_SEQ_CST=ON to compare orderings.
+// The queue is kept short so that the traversal in search() does not hide the cost of the stores and CAS operations.
+TEST_CASE( "concurrentQueue throughput", "[.][benchmark]" )
+{
+   concurrentQueue<int> list;
+   BENCHMARK( "push_back/pop_front, empty queue" )
+   {
+      list.push_back( 1 );
+      return list.pop_front();
+   };
+
+   for ( int i = 0; i < 8; ++i )
+      list.push_back( int(i) );
+   BENCHMARK( "push_back/pop_front, 8 elements" )
+   {
+      list.push_back( 1 );
+      return list.pop_front();
+   };
+
+   // Same as the first case, but under budget; the difference is the cost of the budget fast path
+   concurrentQueue<int> bounded( 1024 );
+   BENCHMARK( "push_back/pop_front, empty queue, bounded" )
+   {
+      bounded.push_back( 1 );
+      return bounded.pop_front();
+   };
+}